@@ -1,8 +1,14 @@
 #include <mpi.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
 #include <time.h>
 #include <sys/time.h>
+#ifdef OPEN_MPI
+#include <mpi-ext.h>
+#endif
 
 #define WIDTH 96
 #define LENGTH 128
@@ -29,6 +35,39 @@
 #define SECOND_HALF 1
 #define TEAM_ONE 0
 #define TEAM_TWO 1
+#define NUM_FIELD_PROCESS (GRID_WIDTH * GRID_LENGTH)
+#define NUM_PLAYER (NUM_PLAYER_PER_TEAM * NUM_TEAM)
+#define NUM_PROCESS (NUM_FIELD_PROCESS + NUM_PLAYER)
+#define COOR_BITS 7
+#define CHALLENGE_BITS 7
+#define RANK_BITS 6
+#define ATTRIBUTE_BITS 4
+#define RNG_COUNTER_BITS 16
+#define BIT_MASK(bits) ((1ull << (bits)) - 1)
+#define TRY(call) do { int err = (call); if (err != MPI_SUCCESS) return err; } while (0)
+
+/**
+ * A player's state packed into one 64 bit word.
+ * From low to high: x and y (COOR_BITS each), ball challenge + 1 (CHALLENGE_BITS, 0 means no challenge),
+ * the process rank the player started on (RANK_BITS), speed and dribbing (ATTRIBUTE_BITS each)
+ * and the player's RNG counter (RNG_COUNTER_BITS). Kick is TOTAL_ATTRIBUTE minus the other two.
+ * The record is everything needed to respawn the player on another process.
+ */
+typedef uint64_t PlayerState;
+
+// State of the players, indexed by team and rank in team.
+// A process only keeps up to date the players it hosts; process 0 keeps the last reported
+// state of every player for the output.
+int players[NUM_TEAM][NUM_PLAYER_PER_TEAM][2], attributes[NUM_TEAM][NUM_PLAYER_PER_TEAM][NUM_ATTRIBUTE];
+int ballChallenge[NUM_TEAM][NUM_PLAYER_PER_TEAM], rngCounter[NUM_TEAM][NUM_PLAYER_PER_TEAM];
+// Rank of the process hosting each player, -1 if that process was lost
+int hostRank[NUM_TEAM][NUM_PLAYER_PER_TEAM];
+// Field processes: records received from the players on their patch this round,
+// and the ones of the last committed round, which are used to respawn lost players
+PlayerState stateBuf[NUM_PLAYER], mirror[NUM_TEAM][NUM_PLAYER_PER_TEAM];
+int numStates;
+uint64_t rngSeed;
+MPI_Datatype playerStateType;
 
 long long wall_clock_time()
 {
@@ -98,6 +137,26 @@ int getPlayerProcessId(int teamId, int rankInTeam) {
 	return GRID_LENGTH * GRID_WIDTH + teamId * NUM_PLAYER_PER_TEAM + rankInTeam;
 }
 
+void getPlayerSlot(int processId, int *teamId, int *rankInTeam) {
+	*teamId = (processId - GRID_WIDTH * GRID_LENGTH) / NUM_PLAYER_PER_TEAM;
+	*rankInTeam = (processId - GRID_WIDTH * GRID_LENGTH) % NUM_PLAYER_PER_TEAM;
+}
+
+/**
+ * get a random number from 0 to n for the player that started on process playerRank.
+ * The number only depends on rngSeed, playerRank and rngCounter, which is then increased,
+ * so the counter is all the RNG state a player carries around.
+ */
+int playerRandomInt(int n, int playerRank, int *rngCounter) {
+	if (n == 0) return 0;
+	uint64_t z = rngSeed + (((uint64_t)playerRank << RNG_COUNTER_BITS) + *rngCounter) * 0x9e3779b97f4a7c15ull;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	z ^= z >> 31;
+	(*rngCounter) ++;
+	return z % n;
+}
+
 // Find the player who can chase the ball in the in the lease number of round
 // Return rank in team of that player
 int getBallChaserIdInTeam(int expectedRoundToCatch[NUM_PLAYER_PER_TEAM]) {
@@ -112,14 +171,15 @@ int getBallChaserIdInTeam(int expectedRoundToCatch[NUM_PLAYER_PER_TEAM]) {
 	return res;
 }
 
-int getBallChallenge(int dribbingSkill) {
-	int r = 1 + randomInt(9);
+int getBallChallenge(int dribbingSkill, int playerRank, int *rngCounter) {
+	int r = 1 + playerRandomInt(9, playerRank, rngCounter);
 	return r * dribbingSkill;
 }
 
 /** 
  * coor: coordinate of the player
  * ball: coordinate of the ball
+ * playerRank, rngCounter: RNG state of the player
  * The player will try to reach the ball in maxChasableDistance steps
  * if he is unable to reach the ball, then he run toward the ball.
  * He always run horizontally first, then vertically.
@@ -127,7 +187,7 @@ int getBallChallenge(int dribbingSkill) {
  * The number of steps player run will be write to steps
  * Return 1 if the player can reach the ball, return 0 otherwise
  */
-int moveToBall(int coor[2], int ball[2],int maxChasableDistance, int *xNew, int *yNew) {
+int moveToBall(int coor[2], int ball[2],int maxChasableDistance, int playerRank, int *rngCounter, int *xNew, int *yNew) {
 	int x = coor[X], y = coor[Y], xBall = ball[X], yBall = ball[Y];
 	if (calDistance(x, y, xBall, yBall) <= maxChasableDistance) {
 		*xNew = xBall;
@@ -137,7 +197,7 @@ int moveToBall(int coor[2], int ball[2],int maxChasableDistance, int *xNew, int
 
 	int maxXSteps = minOf(maxChasableDistance, abs(x-xBall));
 	int minXSteps = maxChasableDistance - minOf(maxChasableDistance, abs(y-yBall));
-	int xSteps = randomInt(maxXSteps - minXSteps);
+	int xSteps = playerRandomInt(maxXSteps - minXSteps, playerRank, rngCounter);
 	xSteps += minXSteps;
 	int ySteps = maxChasableDistance - xSteps;
 	if (xBall > x) {
@@ -175,6 +235,102 @@ int chooseBallWinner(int numContesters, int ball[2], int *xBuf, int *yBuf, int *
 	return rankBuffer[tieBreak[r]];
 }
 
+PlayerState packPlayerState(int coor[2], int ballChallenge, int rank, int attribute[NUM_ATTRIBUTE], int rngCounter) {
+	PlayerState state = rngCounter & BIT_MASK(RNG_COUNTER_BITS);
+	state = (state << ATTRIBUTE_BITS) | (attribute[DRIBBING] & BIT_MASK(ATTRIBUTE_BITS));
+	state = (state << ATTRIBUTE_BITS) | (attribute[SPEED] & BIT_MASK(ATTRIBUTE_BITS));
+	state = (state << RANK_BITS) | (rank & BIT_MASK(RANK_BITS));
+	state = (state << CHALLENGE_BITS) | ((ballChallenge + 1) & BIT_MASK(CHALLENGE_BITS));
+	state = (state << COOR_BITS) | (coor[Y] & BIT_MASK(COOR_BITS));
+	state = (state << COOR_BITS) | (coor[X] & BIT_MASK(COOR_BITS));
+	return state;
+}
+
+void unpackPlayerState(PlayerState state, int coor[2], int *ballChallenge, int *rank, int attribute[NUM_ATTRIBUTE], int *rngCounter) {
+	coor[X] = state & BIT_MASK(COOR_BITS);
+	state >>= COOR_BITS;
+	coor[Y] = state & BIT_MASK(COOR_BITS);
+	state >>= COOR_BITS;
+	*ballChallenge = (int)(state & BIT_MASK(CHALLENGE_BITS)) - 1;
+	state >>= CHALLENGE_BITS;
+	*rank = state & BIT_MASK(RANK_BITS);
+	state >>= RANK_BITS;
+	attribute[SPEED] = state & BIT_MASK(ATTRIBUTE_BITS);
+	state >>= ATTRIBUTE_BITS;
+	attribute[DRIBBING] = state & BIT_MASK(ATTRIBUTE_BITS);
+	state >>= ATTRIBUTE_BITS;
+	attribute[KICK] = TOTAL_ATTRIBUTE - attribute[SPEED] - attribute[DRIBBING];
+	*rngCounter = state & BIT_MASK(RNG_COUNTER_BITS);
+}
+
+// MPI datatype matching PlayerState
+void createPlayerStateType(MPI_Datatype *type) {
+	MPI_Type_contiguous(1, MPI_UINT64_T, type);
+	MPI_Type_commit(type);
+}
+
+int isHost(int rank, int alive, int teamId, int rankInTeam) {
+	return alive && hostRank[teamId][rankInTeam] == rank;
+}
+
+// Bit mask of the processes expected to be alive: the field processes and the hosts of the players
+uint64_t getExpectedMask() {
+	uint64_t mask = BIT_MASK(NUM_FIELD_PROCESS);
+	int i, j;
+	for (i=0; i<NUM_TEAM; i++) {
+		for (j=0; j<NUM_PLAYER_PER_TEAM; j++) {
+			if (hostRank[i][j] != -1) mask |= 1ull << hostRank[i][j];
+		}
+	}
+	return mask;
+}
+
+/**
+ * Send the records in sendBuf to the field processes sendPatch, so that every field process
+ * receives the records of the players standing on its patch, ordered by the sender's rank.
+ * Received records are written to recvBuf and their number to numRecv.
+ * Implementation note: a process may host several players standing on different patches,
+ * so the records are exchanged with a single all to all instead of splitting a communicator per patch.
+ */
+int sendToPatches(MPI_Comm comm, PlayerState *sendBuf, int *sendPatch, int numSend, PlayerState *recvBuf, int *numRecv) {
+	int sendCounts[NUM_PROCESS], sendDispls[NUM_PROCESS], recvCounts[NUM_PROCESS], recvDispls[NUM_PROCESS], next[NUM_PROCESS];
+	PlayerState ordered[NUM_PLAYER];
+	int numProcesses, i;
+	TRY(MPI_Comm_size(comm, &numProcesses));
+	for (i=0; i<numProcesses; i++) {
+		sendCounts[i] = 0;
+	}
+	for (i=0; i<numSend; i++) {
+		sendCounts[sendPatch[i]] ++;
+	}
+	for (i=0; i<numProcesses; i++) {
+		sendDispls[i] = (i == 0) ? 0 : sendDispls[i-1] + sendCounts[i-1];
+		next[i] = sendDispls[i];
+	}
+	for (i=0; i<numSend; i++) {
+		ordered[next[sendPatch[i]]++] = sendBuf[i];
+	}
+	TRY(MPI_Alltoall(sendCounts, 1, MPI_INT, recvCounts, 1, MPI_INT, comm));
+	for (i=0; i<numProcesses; i++) {
+		recvDispls[i] = (i == 0) ? 0 : recvDispls[i-1] + recvCounts[i-1];
+	}
+	*numRecv = recvDispls[numProcesses-1] + recvCounts[numProcesses-1];
+	TRY(MPI_Alltoallv(ordered, sendCounts, sendDispls, playerStateType, recvBuf, recvCounts, recvDispls, playerStateType, comm));
+	return MPI_SUCCESS;
+}
+
+// Field processes: keep the records received this round as the mirror of the players on their patch
+void commitMirror() {
+	int coor[2], bc, playerRank, attribute[NUM_ATTRIBUTE], counter, teamId, rankInTeam;
+	int i;
+	memset(mirror, 0, sizeof(mirror));
+	for (i=0; i<numStates; i++) {
+		unpackPlayerState(stateBuf[i], coor, &bc, &playerRank, attribute, &counter);
+		getPlayerSlot(playerRank, &teamId, &rankInTeam);
+		mirror[teamId][rankInTeam] = stateBuf[i];
+	}
+}
+
 /**
  * After win the ball, players always shoot toward the goal.
  * The location of the goal is determined by halfNo (first or second half) and teamId (Team A or team B)
@@ -217,6 +373,202 @@ int shoot(int halfNo, int teamId, int x, int y, int kick, int *xTarget, int *yTa
 	}
 }
 
+/**
+ * Play one round on comm. Processes that are not alive (simulated failure) host no player.
+ * The id of the ball winner is written to ballWinner, and process 0 receives the records
+ * of all players in roundStates.
+ * Return MPI_SUCCESS, or the error code of the first MPI call that failed.
+ */
+int playRound(MPI_Comm comm, int rank, int isFieldProcess, int alive, int halfNo, int ball[2], int *ballWinner, PlayerState roundStates[NUM_PLAYER], int *numRoundStates) {
+	int expectedRoundToCatch[NUM_TEAM][NUM_PLAYER_PER_TEAM];
+	int xBuf[NUM_PLAYER + 1], yBuf[NUM_PLAYER + 1], ballChallengeBuf[NUM_PLAYER + 1], rankBuffer[NUM_PLAYER + 1];
+	int numSend = 0, sendPatch[NUM_PLAYER], counts[NUM_PROCESS], displs[NUM_PROCESS];
+	PlayerState sendBuf[NUM_PLAYER];
+	int i, j, k;
+
+	// Process 0 broadcast ball location to all other processes
+	TRY(MPI_Bcast(ball, 2, MPI_INT, 0, comm));
+
+	// Strategy discussion among players of the same team
+	// Each player calculate their distance to ball, then calculate how many round he need to get to the ball.
+	// A process may host several players, so this information is shared in a single reduction.
+	for (j=0; j<NUM_TEAM; j++) {
+		for (k=0; k<NUM_PLAYER_PER_TEAM; k++) {
+			expectedRoundToCatch[j][k] = INF;
+			if (!isHost(rank, alive, j, k)) continue;
+			int maxChasableSteps = maxChasableDistance(attributes[j][k][SPEED]);
+			int distToBall = calDistance(ball[X], ball[Y], players[j][k][X], players[j][k][Y]);
+			expectedRoundToCatch[j][k] = distToBall / maxChasableSteps;
+			if (distToBall % maxChasableSteps != 0) expectedRoundToCatch[j][k] ++;
+		}
+	}
+	TRY(MPI_Allreduce(MPI_IN_PLACE, expectedRoundToCatch, NUM_PLAYER, MPI_INT, MPI_MIN, comm));
+
+	// The player who can reach the ball fastest (least number of rounds needed)
+	// will run toward the ball. All other players on his team will not run.
+	for (j=0; j<NUM_TEAM; j++) {
+		for (k=0; k<NUM_PLAYER_PER_TEAM; k++) {
+			if (!isHost(rank, alive, j, k)) continue;
+			int playerRank = getPlayerProcessId(j, k);
+			ballChallenge[j][k] = -1;
+			if (k == getBallChaserIdInTeam(expectedRoundToCatch[j])) {
+				int xNew, yNew;
+				int reached = moveToBall(players[j][k], ball, maxChasableDistance(attributes[j][k][SPEED]), playerRank, &rngCounter[j][k], &xNew, &yNew);
+				players[j][k][X] = xNew; players[j][k][Y] = yNew;
+				ballChallenge[j][k] = reached ? getBallChallenge(attributes[j][k][DRIBBING], playerRank, &rngCounter[j][k]) : -1;
+			}
+			sendBuf[numSend] = packPlayerState(players[j][k], ballChallenge[j][k], playerRank, attributes[j][k], rngCounter[j][k]);
+			sendPatch[numSend] = getPatch(players[j][k]);
+			numSend ++;
+		}
+	}
+
+	// Players send their record to the field process of the patch they stand on
+	TRY(sendToPatches(comm, sendBuf, sendPatch, numSend, stateBuf, &numStates));
+
+	// The field process that has the ball will choose the ball winner and then broadcast the winner id to
+	// all other processes
+	if (rank == getPatch(ball)) {
+		int coor[2], attribute[NUM_ATTRIBUTE], counter;
+		for (i=0; i<numStates; i++) {
+			unpackPlayerState(stateBuf[i], coor, &ballChallengeBuf[i+1], &rankBuffer[i+1], attribute, &counter);
+			xBuf[i+1] = coor[X]; yBuf[i+1] = coor[Y];
+		}
+		*ballWinner = chooseBallWinner(numStates, ball, xBuf, yBuf, ballChallengeBuf, rankBuffer);
+	}
+	TRY(MPI_Bcast(ballWinner, 1, MPI_INT, getPatch(ball), comm));
+
+	// If a player wins the ball, he will shoot is toward the goal, and then the process hosting him
+	// broadcast the new location of the ball to all other processes.
+	if (*ballWinner != -1) {
+		int teamId, rankInTeam;
+		getPlayerSlot(*ballWinner, &teamId, &rankInTeam);
+		if (isHost(rank, alive, teamId, rankInTeam)) {
+			int xNew, yNew;
+			shoot(halfNo, teamId, ball[X], ball[Y], attributes[teamId][rankInTeam][KICK], &xNew, &yNew);
+			ball[X] = xNew; ball[Y] = yNew;
+		}
+		TRY(MPI_Bcast(ball, 2, MPI_INT, hostRank[teamId][rankInTeam], comm));
+	}
+
+	// Field processes transfer players' records to process 0
+	int numToSend = isFieldProcess ? numStates : 0, numProcesses;
+	TRY(MPI_Comm_size(comm, &numProcesses));
+	TRY(MPI_Gather(&numToSend, 1, MPI_INT, counts, 1, MPI_INT, 0, comm));
+	if (rank == 0) {
+		for (i=0; i<numProcesses; i++) {
+			displs[i] = (i == 0) ? 0 : displs[i-1] + counts[i-1];
+		}
+		*numRoundStates = displs[numProcesses-1] + counts[numProcesses-1];
+	}
+	TRY(MPI_Gatherv(stateBuf, numToSend, playerStateType, roundStates, counts, displs, playerStateType, 0, comm));
+	return MPI_SUCCESS;
+}
+
+/**
+ * End of round check that every process is still there and finished the round.
+ * With ULFM the processes agree on roundOk, which fails if a process died.
+ * Otherwise each alive process sets its bit in aliveMask, a missing bit stands in for a dead process.
+ * Return 1 if the round can be committed, 0 if it has to be played again.
+ */
+int heartbeat(MPI_Comm comm, int rank, int alive, int roundOk, uint64_t *aliveMask) {
+#ifdef MPIX_ERR_PROC_FAILED
+	int flag = roundOk;
+	return MPIX_Comm_agree(comm, &flag) == MPI_SUCCESS && flag;
+#else
+	uint64_t beat = alive ? 1ull << rank : 0;
+	uint64_t expected = getExpectedMask();
+	MPI_Allreduce(&beat, aliveMask, 1, MPI_UINT64_T, MPI_BOR, comm);
+	return roundOk && (*aliveMask & expected) == expected;
+#endif
+}
+
+/**
+ * Find the processes lost in the last round and set hostRank of their players to -1.
+ * With ULFM comm is replaced by a communicator of the survivors, and rank and hostRank are
+ * translated to it. Otherwise the processes missing from aliveMask are the lost ones.
+ * Return 0 on success, -1 if a field process was lost.
+ */
+int removeLostProcesses(MPI_Comm *comm, int *rank, uint64_t aliveMask) {
+	int i, j;
+#ifdef MPIX_ERR_PROC_FAILED
+	MPI_Comm survivors;
+	MPI_Group oldGroup, newGroup;
+	int oldRanks[NUM_PROCESS], newRanks[NUM_PROCESS], numProcesses;
+	MPIX_Comm_shrink(*comm, &survivors);
+	MPI_Comm_set_errhandler(survivors, MPI_ERRORS_RETURN);
+	MPI_Comm_size(*comm, &numProcesses);
+	MPI_Comm_group(*comm, &oldGroup);
+	MPI_Comm_group(survivors, &newGroup);
+	for (i=0; i<numProcesses; i++) {
+		oldRanks[i] = i;
+	}
+	MPI_Group_translate_ranks(oldGroup, numProcesses, oldRanks, newGroup, newRanks);
+	MPI_Group_free(&oldGroup);
+	MPI_Group_free(&newGroup);
+	MPI_Comm_free(comm);
+	*comm = survivors;
+	*rank = newRanks[*rank];
+	for (i=0; i<NUM_FIELD_PROCESS; i++) {
+		if (newRanks[i] != i) return -1;
+	}
+	for (i=0; i<NUM_TEAM; i++) {
+		for (j=0; j<NUM_PLAYER_PER_TEAM; j++) {
+			if (hostRank[i][j] == -1) continue;
+			hostRank[i][j] = (newRanks[hostRank[i][j]] == MPI_UNDEFINED) ? -1 : newRanks[hostRank[i][j]];
+		}
+	}
+#else
+	if ((aliveMask & BIT_MASK(NUM_FIELD_PROCESS)) != BIT_MASK(NUM_FIELD_PROCESS)) return -1;
+	for (i=0; i<NUM_TEAM; i++) {
+		for (j=0; j<NUM_PLAYER_PER_TEAM; j++) {
+			if (hostRank[i][j] != -1 && !((aliveMask >> hostRank[i][j]) & 1)) hostRank[i][j] = -1;
+		}
+	}
+#endif
+	return 0;
+}
+
+/**
+ * Hand the players whose host was lost over to the surviving player processes, in turn.
+ * Their state is taken from the records mirrored on the field processes in the last committed round.
+ * Return the number of players taken over, -1 if they can not be respawned.
+ */
+int takeOverLostPlayers(MPI_Comm comm, int rank) {
+	PlayerState lost[NUM_TEAM][NUM_PLAYER_PER_TEAM];
+	int survivors[NUM_PLAYER], numSurvivors = 0, numLost = 0;
+	int i, j, r;
+	for (i=0; i<NUM_TEAM; i++) {
+		for (j=0; j<NUM_PLAYER_PER_TEAM; j++) {
+			lost[i][j] = (hostRank[i][j] == -1) ? mirror[i][j] : 0;
+		}
+	}
+	if (MPI_Allreduce(MPI_IN_PLACE, lost, NUM_PLAYER, MPI_UINT64_T, MPI_BOR, comm) != MPI_SUCCESS) return -1;
+
+	for (r=NUM_FIELD_PROCESS; r<NUM_PROCESS; r++) {
+		int hosting = 0;
+		for (i=0; i<NUM_TEAM; i++) {
+			for (j=0; j<NUM_PLAYER_PER_TEAM; j++) {
+				if (hostRank[i][j] == r) hosting = 1;
+			}
+		}
+		if (hosting) survivors[numSurvivors++] = r;
+	}
+	for (i=0; i<NUM_TEAM; i++) {
+		for (j=0; j<NUM_PLAYER_PER_TEAM; j++) {
+			if (hostRank[i][j] != -1) continue;
+			if (lost[i][j] == 0 || numSurvivors == 0) return -1;
+			hostRank[i][j] = survivors[numLost % numSurvivors];
+			numLost ++;
+			if (hostRank[i][j] == rank) {
+				int playerRank;
+				unpackPlayerState(lost[i][j], players[i][j], &ballChallenge[i][j], &playerRank, attributes[i][j], &rngCounter[i][j]);
+			}
+		}
+	}
+	return numLost;
+}
+
 // Return the id of the scoring team
 // Return -1 if no goal is scored
 int getScoreTeam(int halfNo, int xBall, int yBall) {
@@ -230,56 +582,61 @@ int getScoreTeam(int halfNo, int xBall, int yBall) {
 
 int main(int argc,char *argv[]) {
 	long long startTime = wall_clock_time();
-	int numtasks, rank;
+	int numtasks, rank, worldRank;
 	int i, j, k;
-	int ball[2], players[NUM_TEAM][NUM_PLAYER_PER_TEAM][2], expectedRoundToCatch[NUM_PLAYER_PER_TEAM], ballChallenge[NUM_TEAM][NUM_PLAYER_PER_TEAM];
-	int oldBall[2], oldPlayers[NUM_TEAM][NUM_PLAYER_PER_TEAM][2];
+	int ball[2], oldBall[2], oldPlayers[NUM_TEAM][NUM_PLAYER_PER_TEAM][2];
 	int isFieldProcess = -1, teamId = -1, rankInTeam = -1, row = -1, col = -1;
-	int attribute[NUM_ATTRIBUTE], distToBall, maxChasableSteps, ballChaserId, color, rankInColoredComm, reached;
-	int xBuf[NUM_PLAYER_PER_TEAM * NUM_TEAM + 1], yBuf[NUM_PLAYER_PER_TEAM * NUM_TEAM + 1];
-	int ballChallengeBuf[NUM_PLAYER_PER_TEAM * NUM_TEAM + 1], rankBuffer[NUM_PLAYER_PER_TEAM * NUM_TEAM + 1], ballWinnerBuff[1];
+	int reached, ballWinner;
 	int halfNo, score[2];
+	int resilient = 0, alive = 1, failRank = -1, failRound = -1;
+	int savedBall[2], savedPlayers[NUM_TEAM][NUM_PLAYER_PER_TEAM][2], savedRngCounter[NUM_TEAM][NUM_PLAYER_PER_TEAM];
+	PlayerState roundStates[NUM_PLAYER];
+	int numRoundStates;
+	uint64_t aliveMask = 0;
+	long long seed;
+	MPI_Comm world;
+
+	// -r: resilient mode, the players of a process lost during a round are respawned on the surviving player processes
+	// -f rank round: simulate the failure of process rank at the beginning of round
+	for (i=1; i<argc; i++) {
+		if (strcmp(argv[i], "-r") == 0) resilient = 1;
+		if (strcmp(argv[i], "-f") == 0 && i + 2 < argc) {
+			failRank = atoi(argv[i+1]);
+			failRound = atoi(argv[i+2]);
+			i += 2;
+		}
+	}
 
 	MPI_Init(&argc,&argv);
-	MPI_Comm_size(MPI_COMM_WORLD, &numtasks);
-	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	MPI_Comm_dup(MPI_COMM_WORLD, &world);
+	MPI_Comm_size(world, &numtasks);
+	MPI_Comm_rank(world, &rank);
+	worldRank = rank;
+	createPlayerStateType(&playerStateType);
+#ifdef MPIX_ERR_PROC_FAILED
+	if (resilient) MPI_Comm_set_errhandler(world, MPI_ERRORS_RETURN);
+#endif
 
 	srand(rank * time(NULL));
+	// Players draw their random numbers from a stream shared by all processes, see playerRandomInt
+	seed = time(NULL);
+	MPI_Bcast(&seed, 1, MPI_LONG_LONG, 0, world);
+	rngSeed = seed;
 
 	isFieldProcess = rank < GRID_WIDTH * GRID_LENGTH;
 	if (isFieldProcess) {
 		row = rank / GRID_LENGTH;
 		col = rank % GRID_LENGTH;
-		color = rank;
 	}
 	if (!isFieldProcess) {
-		teamId = (rank - GRID_WIDTH * GRID_LENGTH ) / NUM_PLAYER_PER_TEAM;
-		rankInTeam = (rank - GRID_WIDTH * GRID_LENGTH) % NUM_PLAYER_PER_TEAM;
-	}
-
-	int fieldRanks[GRID_WIDTH * GRID_LENGTH], teamRanks[NUM_TEAM][NUM_PLAYER_PER_TEAM];
-	for (i=0; i<GRID_WIDTH; i++) {
-		for (j=0; j<GRID_LENGTH; j++) {
-			fieldRanks[i * GRID_LENGTH + j] = i * GRID_LENGTH + j;
-		}
+		getPlayerSlot(rank, &teamId, &rankInTeam);
 	}
+	// Each player process starts hosting its own player
 	for (i=0; i<NUM_TEAM; i++) {
 		for (j=0; j<NUM_PLAYER_PER_TEAM; j++) {
-			teamRanks[i][j] = GRID_WIDTH * GRID_LENGTH + i * NUM_PLAYER_PER_TEAM + j;
+			hostRank[i][j] = getPlayerProcessId(i, j);
 		}
 	}
-	// worldGroup: group of all processes
-	// fieldGroup: group of all field processes
-	// teamGroup: group of players from the same team
-	MPI_Group worldGroup, fieldGroup , teamGroup[NUM_TEAM];
-	MPI_Comm fieldComm, teamComm[NUM_TEAM], coloredComm;
-	MPI_Comm_group(MPI_COMM_WORLD, &worldGroup);
-	MPI_Group_incl(worldGroup, GRID_WIDTH * GRID_LENGTH, fieldRanks, &fieldGroup);
-	MPI_Comm_create(MPI_COMM_WORLD, fieldGroup, &fieldComm);
-	for (i=0; i<NUM_TEAM; i++) {
-		MPI_Group_incl(worldGroup, NUM_PLAYER_PER_TEAM, teamRanks[i], &teamGroup[i]);
-		MPI_Comm_create(MPI_COMM_WORLD, teamGroup[i], &teamComm[i]);
-	}
 
 	// Initiate ball position 
 	if (isFieldProcess) {
@@ -287,122 +644,90 @@ int main(int argc,char *argv[]) {
 		oldBall[X] = ball[X]; oldBall[Y] = ball[Y];
 		score[0] = 0; score[1] = 0;
 	} else {
-		initiateAttribute(attribute);
-		maxChasableSteps = maxChasableDistance(attribute[SPEED]);
+		initiateAttribute(attributes[teamId][rankInTeam]);
 		players[teamId][rankInTeam][X] = randomInt(LENGTH);
 		players[teamId][rankInTeam][Y] = randomInt(WIDTH);
-		
+		ballChallenge[teamId][rankInTeam] = -1;
+		rngCounter[teamId][rankInTeam] = 0;
 	}
 
-	for (i=0; i<NUM_ROUND_PER_HALF * 2; i++) {
-		halfNo = (i < NUM_ROUND_PER_HALF) ? 0 : 1;
-
-		// Process 0 broadcast ball location to all other processes
-		MPI_Bcast(ball, 2, MPI_INT, 0, MPI_COMM_WORLD);
-		MPI_Barrier(MPI_COMM_WORLD);
-
-		color = rank;	
-		
-		// Strategy discussion among players of the same team
+	// In resilient mode the field processes start with a mirror of the players on their patch
+	if (resilient) {
+		PlayerState initState[1];
+		int initPatch[1], numInit = 0;
 		if (!isFieldProcess) {
-			// Each player calculate their distance to ball, then calculate how many round he need to get to the ball
-			// and then broadcast this information to his teammates.
-			ballChallenge[teamId][rankInTeam] = -1;
-			distToBall = calDistance(ball[X], ball[Y], players[teamId][rankInTeam][X], players[teamId][rankInTeam][Y]);
-			expectedRoundToCatch[rankInTeam] = distToBall / maxChasableSteps;
-			if (distToBall % maxChasableSteps != 0) expectedRoundToCatch[rankInTeam] ++;
-			for (j=0; j<NUM_PLAYER_PER_TEAM; j++) {
-				MPI_Bcast(&expectedRoundToCatch[j], 1, MPI_INT, j, teamComm[teamId]);
-				MPI_Barrier(teamComm[teamId]);
-			}
-			
-			// The player who can reach the ball fastest (least number of rounds needed) 
-			// will run toward the ball. All other players on his team will not run.
-			ballChaserId = getBallChaserIdInTeam(expectedRoundToCatch);
-			reached = 0;
-			if (rankInTeam == ballChaserId) {
-				int xNew, yNew;
-				reached = moveToBall(players[teamId][rankInTeam], ball, maxChasableSteps, &xNew, &yNew);
-				players[teamId][rankInTeam][X] = xNew; players[teamId][rankInTeam][Y] = yNew;
-				ballChallenge[teamId][rankInTeam] = reached ? getBallChallenge(attribute[DRIBBING]) : -1;
-			}
-			color = getPatch(players[teamId][rankInTeam]);
+			initState[0] = packPlayerState(players[teamId][rankInTeam], -1, rank, attributes[teamId][rankInTeam], 0);
+			initPatch[0] = getPatch(players[teamId][rankInTeam]);
+			numInit = 1;
 		}
+		sendToPatches(world, initState, initPatch, numInit, stateBuf, &numStates);
+		if (isFieldProcess) commitMirror();
+	}
 
-		// Players send their coordinate, ball challenge and rank to the respected field process
-		// Implementation note: players that stand on the same patch will share the same color with the patch
-		// which is the process rank of the corresponding field process.
-		MPI_Comm_split(MPI_COMM_WORLD, color, rank, &coloredComm);
-		MPI_Barrier(MPI_COMM_WORLD);
-		MPI_Gather(&players[teamId][rankInTeam][X], 1, MPI_INT, xBuf, 1, MPI_INT, 0, coloredComm);
-		MPI_Barrier(MPI_COMM_WORLD);
-		MPI_Gather(&players[teamId][rankInTeam][Y], 1, MPI_INT, yBuf, 1, MPI_INT, 0, coloredComm);
-		MPI_Barrier(MPI_COMM_WORLD);
-		MPI_Gather(&ballChallenge[teamId][rankInTeam], 1, MPI_INT, ballChallengeBuf, 1, MPI_INT, 0, coloredComm);
-		MPI_Barrier(MPI_COMM_WORLD);
-		MPI_Gather(&rank, 1, MPI_INT, rankBuffer, 1, MPI_INT, 0, coloredComm);
-		MPI_Barrier(MPI_COMM_WORLD);
-
-		// The field process that has the ball will choose the ball winner and then broadcast the winner id to 
-		// all other processes
-		if (rank == getPatch(ball)) {
-			int numContesters;
-			MPI_Comm_size(coloredComm, &numContesters);
-			numContesters --;
-			ballWinnerBuff[0] = chooseBallWinner(numContesters, ball, xBuf, yBuf, ballChallengeBuf, rankBuffer);
-		}
-		MPI_Bcast(ballWinnerBuff, 1, MPI_INT, getPatch(ball), MPI_COMM_WORLD);
-		MPI_Barrier(MPI_COMM_WORLD);
+	for (i=0; i<NUM_ROUND_PER_HALF * 2; i++) {
+		halfNo = (i < NUM_ROUND_PER_HALF) ? 0 : 1;
 
-		// If a player wins the ball, he will shoot is toward the goal, and then broadcast 
-		// the new location of the ball to all other processes.
-		if (rank == ballWinnerBuff[0]) {
-			int xNew, yNew;
-			shoot(halfNo, teamId, ball[X], ball[Y], attribute[KICK], &xNew, &yNew);
-			ball[X] = xNew; ball[Y] = yNew;
+		// Simulated failure: with ULFM the process is killed,
+		// otherwise it stops hosting players and sending heartbeats
+		if (resilient && worldRank == failRank && i == failRound) {
+#ifdef MPIX_ERR_PROC_FAILED
+			raise(SIGKILL);
+#else
+			alive = 0;
+#endif
 		}
-		if (ballWinnerBuff[0] != -1) {
-			MPI_Bcast(ball, 2, MPI_INT, ballWinnerBuff[0], MPI_COMM_WORLD);
-			MPI_Barrier(MPI_COMM_WORLD);
+		if (resilient) {
+			memcpy(savedBall, ball, sizeof(ball));
+			memcpy(savedPlayers, players, sizeof(players));
+			memcpy(savedRngCounter, rngCounter, sizeof(rngCounter));
 		}
-		MPI_Comm_free(&coloredComm);
 
-		// Transfer players' data to process 0
-		if (rank == 0 || rank >= GRID_LENGTH * GRID_WIDTH) {
-			color = 0;
-		} else {
-			color = 1;
-		}
-		MPI_Comm_split(MPI_COMM_WORLD, color, rank, &coloredComm);
-		MPI_Barrier(MPI_COMM_WORLD);
-		if (color == 0) {
-			int tmpX = 0, tmpY = 0, tmpBc = -1;
-			if (rank != 0) {
-				tmpX = players[teamId][rankInTeam][X];
-				tmpY = players[teamId][rankInTeam][Y];
-				tmpBc = ballChallenge[teamId][rankInTeam];
+		int err = playRound(world, rank, isFieldProcess, alive, halfNo, ball, &ballWinner, roundStates, &numRoundStates);
+
+		// In resilient mode a round broken by a failure is rolled back and played again,
+		// after the players of the lost processes are respawned from their mirrors.
+		if (resilient) {
+#ifdef MPIX_ERR_PROC_FAILED
+			if (err != MPI_SUCCESS) MPIX_Comm_revoke(world);
+#endif
+			if (!heartbeat(world, rank, alive, err == MPI_SUCCESS, &aliveMask)) {
+				int numLost = -1;
+				memcpy(ball, savedBall, sizeof(ball));
+				memcpy(players, savedPlayers, sizeof(players));
+				memcpy(rngCounter, savedRngCounter, sizeof(rngCounter));
+				if (removeLostProcesses(&world, &rank, aliveMask) == 0) {
+					numLost = takeOverLostPlayers(world, rank);
+				}
+				if (numLost < 0) {
+					if (rank == 0) printf("Unable to recover from the failure in round %d\n", i);
+					MPI_Abort(world, 1);
+				}
+				if (rank == 0) printf("Round %d played again, %d players taken over\n", i, numLost);
+				i --;
+				continue;
 			}
-			MPI_Gather(&tmpX, 1, MPI_INT, xBuf, 1, MPI_INT, 0, coloredComm);
-			MPI_Gather(&tmpY, 1, MPI_INT, yBuf, 1, MPI_INT, 0, coloredComm);
-			MPI_Gather(&tmpBc, 1, MPI_INT, ballChallengeBuf, 1, MPI_INT, 0, coloredComm);
+			if (isFieldProcess) commitMirror();
 		}
-		MPI_Comm_free(&coloredComm);
 
 		// Process 0 print output
 		if (rank == 0) {
 			for (j=0; j<NUM_TEAM; j++) {
 				for (k=0; k<NUM_PLAYER_PER_TEAM; k++) {
-					int index = 1 + j * NUM_PLAYER_PER_TEAM + k;
 					oldPlayers[j][k][X] = players[j][k][X];
 					oldPlayers[j][k][Y] = players[j][k][Y];
-					players[j][k][X] = xBuf[index];
-					players[j][k][Y] = yBuf[index];
-					ballChallenge[j][k] = ballChallengeBuf[index];
 				}
 			}
+			for (j=0; j<numRoundStates; j++) {
+				int coor[2], bc, playerRank, attribute[NUM_ATTRIBUTE], counter;
+				unpackPlayerState(roundStates[j], coor, &bc, &playerRank, attribute, &counter);
+				getPlayerSlot(playerRank, &teamId, &rankInTeam);
+				players[teamId][rankInTeam][X] = coor[X];
+				players[teamId][rankInTeam][Y] = coor[Y];
+				ballChallenge[teamId][rankInTeam] = bc;
+			}
 			printf("Round %d\n", i);
 			printf("Ball is in %d %d\n", ball[X], ball[Y]);
-			printf("%d win the ball\n", ballWinnerBuff[0]);
+			printf("%d win the ball\n", ballWinner);
 			
 			for (j=0; j<NUM_TEAM; j++) {
 				printf("Team %d:\n", j + 1);
@@ -410,7 +735,7 @@ int main(int argc,char *argv[]) {
 					printf("%2d, old x: %3d, old y: %2d, ", k, oldPlayers[j][k][X], oldPlayers[j][k][Y]);
 					printf("final x: %3d, final y: %2d, ", players[j][k][X], players[j][k][Y]);
 					reached = (oldBall[X]==players[j][k][X] && oldBall[Y]==players[j][k][Y]);
-					int kicked = (getPlayerProcessId(j, k) == ballWinnerBuff[0]);
+					int kicked = (getPlayerProcessId(j, k) == ballWinner);
 					printf("reached %d, kicked %d, bc %4d\n", reached, kicked, ballChallenge[j][k]);
 				}
 			}
@@ -428,6 +753,8 @@ int main(int argc,char *argv[]) {
 	}
 
 	
+	MPI_Comm_free(&world);
+	MPI_Type_free(&playerStateType);
 	MPI_Finalize();
 	long long endTime = wall_clock_time();
 	if (rank == 0) {
@@ -435,4 +762,4 @@ int main(int argc,char *argv[]) {
 	}
 	
 	return 0;
-}
\ No newline at end of file
+}
@@ -1,6 +1,7 @@
 #include <mpi.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <time.h>
 #include <sys/time.h>
 
@@ -11,6 +12,8 @@
 #define TOTAL_STEPS_RAN 4
 #define NUM_REACH_BALL 5
 #define NUM_KICK_BALL 6
+#define COOR_BITS 7
+#define COOR_MASK ((1u << COOR_BITS) - 1)
 
 #define WIDTH 64
 #define LENGTH 128
@@ -18,8 +21,7 @@
 #define MAX_STEP 10
 #define NUM_ROUND 900
 #define TAG_SEND_BALL_COOR 0
-#define TAG_SEND_PLAYER_INFO 1
-#define TAG_SEND_WINNER_ID 2
+#define TAG_SEND_WINNER_ID 1
 #define SIZE_INFO 7
 
 long long wall_clock_time()
@@ -98,6 +100,34 @@ int move(int x, int y, int xBall, int yBall, int *steps, int *xNew, int *yNew) {
 	return 0;
 }
 
+/**
+ * A player's per-round state packed into one 32 bit word.
+ * Each coordinate takes COOR_BITS bits: xOld, yOld, xNew, yNew from low to high.
+ * Running totals are not part of the record, the field process keeps them itself.
+ */
+typedef uint32_t PlayerState;
+
+PlayerState packPlayerState(int xOld, int yOld, int xNew, int yNew) {
+	return (PlayerState)(xOld & COOR_MASK)
+		| (PlayerState)(yOld & COOR_MASK) << COOR_BITS
+		| (PlayerState)(xNew & COOR_MASK) << (2 * COOR_BITS)
+		| (PlayerState)(yNew & COOR_MASK) << (3 * COOR_BITS);
+}
+
+// Unpack a player's state into info[X_OLD..Y_NEW]
+void unpackPlayerState(PlayerState state, int info[SIZE_INFO]) {
+	info[X_OLD] = state & COOR_MASK;
+	info[Y_OLD] = (state >> COOR_BITS) & COOR_MASK;
+	info[X_NEW] = (state >> (2 * COOR_BITS)) & COOR_MASK;
+	info[Y_NEW] = (state >> (3 * COOR_BITS)) & COOR_MASK;
+}
+
+// MPI datatype matching PlayerState
+void createPlayerStateType(MPI_Datatype *type) {
+	MPI_Type_contiguous(1, MPI_UINT32_T, type);
+	MPI_Type_commit(type);
+}
+
 // Return the id of the ball winner, -1 if noone wins
 int getBallWinner(int info[NUM_PLAYER][SIZE_INFO], int xBall, int yBall) {
 	int reachedCounter = 0;
@@ -122,8 +152,9 @@ int main(int argc,char *argv[]) {
 	int x[NUM_PLAYER], y[NUM_PLAYER];
 	int xBall, yBall, xBallOld, yBallOld, winnerId;
 	int id, xOld, yOld, xNew, yNew, stepsRan;
-	int totalStepsRan = 0, numReachBall = 0, numKickBall = 0;
-	int infoBuffer[SIZE_INFO], playersBuffer[NUM_PLAYER][SIZE_INFO], ballBuffer[2], winnerBuffer[1];
+	int playersBuffer[NUM_PLAYER][SIZE_INFO], ballBuffer[2], winnerBuffer[1];
+	PlayerState state, stateBuffer[NUM_PLAYER + 1];
+	MPI_Datatype playerStateType;
 	
 	MPI_Request sendReqs[NUM_PLAYER], recvReqs[NUM_PLAYER];
 	MPI_Status sendStats[NUM_PLAYER], recvStats[NUM_PLAYER];
@@ -131,12 +162,18 @@ int main(int argc,char *argv[]) {
 	MPI_Init(&argc,&argv);
 	MPI_Comm_size(MPI_COMM_WORLD, &numtasks);
 	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	createPlayerStateType(&playerStateType);
 
 	srand(rank * time(NULL));
 	// Initialize ball and players' coordinate
 	if (rank == 0) {
 		xBall = randomInt(LENGTH);
 		yBall = randomInt(WIDTH);
+		for (j=0; j<NUM_PLAYER; j++) {
+			playersBuffer[j][TOTAL_STEPS_RAN] = 0;
+			playersBuffer[j][NUM_REACH_BALL] = 0;
+			playersBuffer[j][NUM_KICK_BALL] = 0;
+		}
 	} else {
 		xOld = randomInt(LENGTH);
 		yOld = randomInt(WIDTH);
@@ -157,22 +194,21 @@ int main(int argc,char *argv[]) {
 			MPI_Waitall(1, &recvReqs[id], recvStats);
 		}
 
-		// Player run and send info to field
+		// Player run and send his packed state to field in a single gather
+		// The field derives the running totals from the coordinates, so they are never sent
+		state = 0;
+		if (rank != 0) {
+			xBall = ballBuffer[0]; yBall = ballBuffer[1];
+			move(xOld, yOld, xBall, yBall, &stepsRan, &xNew, &yNew);
+			state = packPlayerState(xOld, yOld, xNew, yNew);
+		}
+		MPI_Gather(&state, 1, playerStateType, stateBuffer, 1, playerStateType, 0, MPI_COMM_WORLD);
 		if (rank == 0) {
 			for (j=0; j<NUM_PLAYER; j++) {
-				MPI_Irecv(playersBuffer[j] , SIZE_INFO, MPI_INT, j + 1, TAG_SEND_PLAYER_INFO, MPI_COMM_WORLD, &recvReqs[j]);
+				unpackPlayerState(stateBuffer[j + 1], playersBuffer[j]);
+				playersBuffer[j][TOTAL_STEPS_RAN] += calDistance(playersBuffer[j][X_OLD], playersBuffer[j][Y_OLD], playersBuffer[j][X_NEW], playersBuffer[j][Y_NEW]);
+				playersBuffer[j][NUM_REACH_BALL] += calDistance(playersBuffer[j][X_NEW], playersBuffer[j][Y_NEW], xBall, yBall) == 0;
 			}
-			MPI_Waitall(NUM_PLAYER, recvReqs, recvStats);
-		}
-		if (rank != 0) {
-			xBall = ballBuffer[0]; yBall = ballBuffer[1];
-			int reachable = move(xOld, yOld, xBall, yBall, &stepsRan, &xNew, &yNew);
-			totalStepsRan += stepsRan;
-			numReachBall += reachable;
-			infoBuffer[X_OLD] = xOld; infoBuffer[Y_OLD] = yOld; infoBuffer[X_NEW] = xNew; infoBuffer[Y_NEW] = yNew; 
-			infoBuffer[TOTAL_STEPS_RAN] = totalStepsRan; infoBuffer[NUM_REACH_BALL] = numReachBall; infoBuffer[NUM_KICK_BALL] = numKickBall;
-			MPI_Isend(infoBuffer, SIZE_INFO, MPI_INT, 0, TAG_SEND_PLAYER_INFO, MPI_COMM_WORLD, &sendReqs[id]);
-			MPI_Waitall(1, &sendReqs[id], sendStats);
 		}
 
 		// // Field decide who get the ball
@@ -199,7 +235,6 @@ int main(int argc,char *argv[]) {
 		}
 		if (rank != 0) {
 			if (id == winnerBuffer[0]) {
-				numKickBall ++;
 				ballBuffer[0] = randomInt(LENGTH); ballBuffer[1] = randomInt(WIDTH);
 				MPI_Isend(ballBuffer, 2, MPI_INT, 0, TAG_SEND_BALL_COOR, MPI_COMM_WORLD, &sendReqs[0]);
 				MPI_Waitall(1, &sendReqs[0], sendStats);
@@ -229,6 +264,7 @@ int main(int argc,char *argv[]) {
 		}
 	}
 
+	MPI_Type_free(&playerStateType);
 	MPI_Finalize();
 	
 	long long endTime = wall_clock_time();